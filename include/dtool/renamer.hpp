@@ -14,6 +14,9 @@
 #	include <stdexcept>
 #	include <iostream>
 #	include <numeric>
+#	include <algorithm>
+#	include <chrono>
+#	include <exception>
 
 namespace dtool::renamer {
 	// using ItemIndex = std::size_t;
@@ -229,10 +232,13 @@ namespace dtool::renamer {
 		public: explicit Pattern(std::string_view rawPattern);
 		public: auto generate(std::string_view originalName, ItemIndex index) const -> std::string {
 			std::string result;
+			this->generate(originalName, index, result);
+			return result;
+		}
+		public: auto generate(std::string_view originalName, ItemIndex index, std::string& output) const -> void {
 			for (auto const& element: this->m_elements) {
-				result += element.generate(originalName, index);
+				output += element.generate(originalName, index);
 			}
-			return result;
 		}
 		public: auto raw() const -> std::string {
 			std::string result;
@@ -250,12 +256,94 @@ namespace dtool::renamer {
 		private: auto parseSpecialPattern(std::string_view rawSpecialPattern) -> void;
 	};
 
+	// Stores strings in large blocks. Stored strings stay valid until the arena is reset or destroyed, and resetting
+	// keeps the blocks for reuse.
+	class NameArena {
+		public: using Self = NameArena;
+		public: static constexpr std::size_t BLOCK_SIZE = 64 * 1024;
+		private: struct Block {
+			std::unique_ptr<char[]> data;
+			std::size_t size;
+		};
+		private: std::vector<Block> m_blocks;
+		private: std::size_t m_block = 0;
+		private: std::size_t m_offset = 0;
+		public: auto store(std::string_view name) -> std::string_view {
+			if (name.empty()) {
+				return std::string_view();
+			}
+			for (; this->m_block < this->m_blocks.size(); ++this->m_block, this->m_offset = 0) {
+				if (this->m_blocks[this->m_block].size - this->m_offset >= name.size()) {
+					break;
+				}
+			}
+			if (this->m_block == this->m_blocks.size()) {
+				auto size = std::max(BLOCK_SIZE, name.size());
+				this->m_blocks.push_back(Block { std::make_unique<char[]>(size), size });
+			}
+			auto* result = this->m_blocks[this->m_block].data.get() + this->m_offset;
+			std::copy(name.begin(), name.end(), result);
+			this->m_offset += name.size();
+			return std::string_view(result, name.size());
+		}
+		public: auto reset() noexcept -> void {
+			this->m_block = 0;
+			this->m_offset = 0;
+		}
+		public: auto usedBytes() const noexcept -> std::size_t {
+			std::size_t result = this->m_offset;
+			for (std::size_t i = 0; i < this->m_block && i < this->m_blocks.size(); ++i) {
+				result += this->m_blocks[i].size;
+			}
+			return result;
+		}
+		public: auto reservedBytes() const noexcept -> std::size_t {
+			std::size_t result = 0;
+			for (auto const& block: this->m_blocks) {
+				result += block.size;
+			}
+			return result;
+		}
+	};
+
+	namespace commit {
+		enum class Backend {
+			SYNCHRONOUS,
+			IO_URING
+		};
+
+		struct Options {
+			Backend backend = Backend::SYNCHRONOUS;
+			unsigned queueDepth = 64;
+		};
+
+		enum class Issue {
+			EMPTY_NAME,
+			INVALID_CHARACTER,
+			INVALID_COMPONENT,
+			NAME_TOO_LONG,
+			DUPLICATE,
+			ALREADY_EXISTS
+		};
+
+		struct Problem {
+			std::size_t index;
+			Issue issue;
+		};
+
+		struct Report {
+			std::vector<Problem> problems;
+		};
+
+		auto describe(Issue issue) -> char const*;
+	} // namespace commit
+
 	class Core {
 		public: using Self = Core;
 		public: using Paths = std::set<std::filesystem::path>;
 		public: struct Preview {
 			Core::Paths::iterator origin;
-			std::string newName;
+			std::string_view newName;
 		};
 		public: using Previews = std::vector<Preview>;
 		enum class DoneChoice {
@@ -267,7 +355,26 @@ namespace dtool::renamer {
 		public: enum class ReorderMethod {
 			SORT_BY_NAME,
 			SORT_BY_MODIFIED_TIME,
-			REVERSE
+			REVERSE,
+			SORT_BY_NATURAL_NAME,
+			SORT_BY_EXTENSION,
+			SORT_BY_SIZE,
+			SORT_BY_CHANGED_TIME
+		};
+		public: enum class SortField {
+			NAME,
+			NATURAL_NAME,
+			EXTENSION,
+			SIZE,
+			MODIFIED_TIME,
+			CHANGED_TIME
+		};
+		public: struct SortKey {
+			SortField field;
+			bool descending;
+		};
+		public: struct SortInfo {
+			std::vector<SortKey> keys;
 		};
 		public: struct SwapInfo {
 			ItemIndex left;
@@ -279,15 +386,89 @@ namespace dtool::renamer {
 		public: struct RemoveInfo {
 			ItemIndex index;
 		};
-		public: using Action = std::variant<decltype(NO_OP), DoneChoice, Pattern, SwapInfo, ReorderMethod, AddInfo, RemoveInfo>;
+		public: struct MemoryUsage {
+			std::size_t names;
+			std::size_t previews;
+			std::size_t paths;
+		};
+		public: using Action = std::variant<decltype(NO_OP), DoneChoice, Pattern, SwapInfo, ReorderMethod, SortInfo, AddInfo, RemoveInfo>;
 		public: using ActionHandler = std::function<auto (Pattern const&, Previews const&) -> Action>;
 		private: ActionHandler m_handler;
-		public: Core(ActionHandler handler): m_handler(handler) {
+		private: commit::Options m_commitOptions;
+		private: Self::Paths m_paths;
+		private: Self::Previews m_previews;
+		private: NameArena m_names;
+		private: NameArena m_spareNames;
+		private: std::size_t m_liveNameBytes = 0;
+		public: Core(
+			ActionHandler handler, commit::Options commitOptions = commit::Options()
+		): m_handler(handler), m_commitOptions(commitOptions) {
 		}
+		// Returns each path as `insert` would store it, or an empty path if it would be ignored.
+		public: static auto uniform(std::vector<std::filesystem::path> const& inputPaths) -> std::vector<std::filesystem::path>;
+		public: auto insert(Self::Paths const& inputPaths) -> std::size_t;
+		public: auto insert(std::vector<std::filesystem::path> const& inputPaths) -> std::size_t;
 		public: auto interact(Self::Paths const& inputPaths) -> void {
 			this->interact(Pattern("{o}"), inputPaths);
 		}
 		public: auto interact(Pattern pattern = Pattern("{o}"), Self::Paths const& inputPaths = Self::Paths()) -> void;
+		public: auto memoryUsage() const -> MemoryUsage;
+		private: auto regenerate(Pattern const& pattern, Self::Previews::size_type from = 0) -> void;
+	};
+
+	auto sortPreviews(Core::Previews& previews, std::vector<Core::SortKey> const& keys) -> void;
+
+	class BadCommit: public std::runtime_error {
+		private: commit::Report m_report;
+		public: BadCommit(): BadCommit("Not a valid commit") {
+		}
+		public: BadCommit(std::string const& message): std::runtime_error(message) {
+		}
+		public: BadCommit(std::string const& message, commit::Report report): std::runtime_error(message), m_report(std::move(report)) {
+		}
+		public: auto report() const noexcept -> commit::Report const& {
+			return this->m_report;
+		}
+	};
+
+	namespace commit {
+		struct Move {
+			std::filesystem::path from;
+			std::filesystem::path to;
+		};
+
+		struct Plan {
+			std::vector<std::filesystem::path> directories;
+			std::vector<Move> moves;
+		};
+
+		auto validate(Core::Previews const& previews) -> Report;
+		auto plan(Core::Previews const& previews) -> Plan;
+		auto execute(Plan const& plan, Options const& options = Options()) -> void;
+		auto isIoUringAvailable(unsigned queueDepth = 1) -> bool;
+		auto moveFile(std::filesystem::path const& from, std::filesystem::path const& to) -> void;
+	} // namespace commit
+
+	struct WatchOptions {
+		std::chrono::milliseconds window = std::chrono::milliseconds(200);
+		std::filesystem::path counterFile;
+		commit::Options commitOptions;
+	};
+
+	class Watcher {
+		public: using Self = Watcher;
+		public: using BatchHandler = std::function<auto (Core::Previews const&, std::exception_ptr) -> bool>;
+		public: using Options = WatchOptions;
+		private: std::filesystem::path m_directory;
+		private: Pattern m_pattern;
+		private: Options m_options;
+		private: std::size_t m_counter;
+		public: Watcher(std::filesystem::path const& directory, Pattern pattern, Options options = Options());
+		public: auto counter() const noexcept -> std::size_t {
+			return this->m_counter;
+		}
+		public: auto run(BatchHandler const& handler) -> void;
+		private: auto persistCounter() const -> void;
 	};
 } // namespace dtool::renamer
 
@@ -10,8 +10,13 @@
 #include <sstream>
 #include <filesystem>
 #include <stdexcept>
-#include <queue>
-#include <deque>
+#include <fstream>
+#include <cctype>
+#include <limits>
+#include <optional>
+#include <vector>
+#include <variant>
+#include <exception>
 
 namespace {
 	struct ConsoleGuard {
@@ -40,6 +45,7 @@ namespace {
 	};
 
 	bool g_quiet = false;
+	dtool::renamer::commit::Options g_commitOptions;
 
 	template <typename... T> auto standardOutput(T&&... toOutput) -> void {
 		if (!g_quiet) {
@@ -52,14 +58,17 @@ namespace {
 	}
 
 	template <typename... T> auto standardOutputWarning(T&&... toOutput) -> void {
-		((std::cerr << "\x1b[33mWarning\x1b[0m: " << std::forward<T>(toOutput)), ...) << std::flush;
+		((std::cerr << "\x1b[33mWarning\x1b[0m: ") << ... << std::forward<T>(toOutput)) << std::flush;
 	}
 
 	template <typename... T> auto standardOutputError(T&&... toOutput) -> void {
-		((std::cerr << "\x1b[31mError\x1b[0m: " << std::forward<T>(toOutput)), ...) << std::flush;
+		((std::cerr << "\x1b[31mError\x1b[0m: ") << ... << std::forward<T>(toOutput)) << std::flush;
 	}
 
-	auto displayPreviews(dtool::renamer::Pattern const& pattern, dtool::renamer::Core::Previews const& previews) -> void {
+	auto displayPreviews(
+		dtool::renamer::Pattern const& pattern, dtool::renamer::Core::Previews const& previews,
+		dtool::renamer::commit::Report const& report
+	) -> void {
 		standardOutput(
 			"---\n"
 			"Current pattern: ["
@@ -70,6 +79,7 @@ namespace {
 			standardOutput("No file selected.\n");
 		} else {
 			std::filesystem::path lastPath;
+			auto problem = report.problems.begin();
 			for (dtool::renamer::Core::Previews::size_type i = 0; i < previews.size(); ++i) {
 				auto folder = previews[i].origin->parent_path();
 				if (lastPath != folder) {
@@ -82,11 +92,18 @@ namespace {
 					")  ",
 					previews[i].origin->filename().string(),
 					" -> ",
-					previews[i].newName,
-					"\n"
+					previews[i].newName
 				);
+				if (problem != report.problems.end() && problem->index == i) {
+					standardOutput("  \x1b[31m(", dtool::renamer::commit::describe(problem->issue), ")\x1b[0m");
+					++problem;
+				}
+				standardOutput("\n");
 			}
 		}
+		if (!report.problems.empty()) {
+			standardOutput(report.problems.size(), " problem(s) must be solved before confirming.\n");
+		}
 		standardOutput("---\n");
 	}
 
@@ -102,16 +119,39 @@ namespace {
 		return dtool::renamer::Core::NO_OP;
 	}
 
-	template <typename GetterT> auto reorderHandler(GetterT& getter) -> dtool::renamer::Core::Action {
-		standardOutput(
-			"Available sort methods:\n"
-			"  (1)  Sort by name\n"
-			"  (2)  Sort by last modifed time\n"
-			"  (3)  Reverse\n"
-			"Select a reorder method: "
-		);
-		int choice;
-		getter(choice);
+	auto parseSortKeys(std::string const& rawKeys) -> dtool::renamer::Core::SortInfo {
+		dtool::renamer::Core::SortInfo result;
+		std::istringstream in(rawKeys);
+		for (std::string rawKey; std::getline(in, rawKey, ','); ) {
+			bool descending = !rawKey.empty() && rawKey[0] == '-';
+			if (descending) {
+				rawKey.erase(0, 1);
+			}
+			dtool::renamer::Core::SortField field;
+			if (rawKey == "n") {
+				field = dtool::renamer::Core::SortField::NAME;
+			} else if (rawKey == "N") {
+				field = dtool::renamer::Core::SortField::NATURAL_NAME;
+			} else if (rawKey == "e") {
+				field = dtool::renamer::Core::SortField::EXTENSION;
+			} else if (rawKey == "s") {
+				field = dtool::renamer::Core::SortField::SIZE;
+			} else if (rawKey == "m") {
+				field = dtool::renamer::Core::SortField::MODIFIED_TIME;
+			} else if (rawKey == "c") {
+				field = dtool::renamer::Core::SortField::CHANGED_TIME;
+			} else {
+				throw std::invalid_argument("Unknown sort key '" + rawKey + "'.");
+			}
+			result.keys.push_back(dtool::renamer::Core::SortKey { field, descending });
+		}
+		if (result.keys.empty()) {
+			throw std::invalid_argument("No sort key given.");
+		}
+		return result;
+	}
+
+	auto reorderMethodOf(int choice) -> std::optional<dtool::renamer::Core::ReorderMethod> {
 		switch (choice) {
 			case 1: {
 				return dtool::renamer::Core::ReorderMethod::SORT_BY_NAME;
@@ -122,10 +162,57 @@ namespace {
 			case 3: {
 				return dtool::renamer::Core::ReorderMethod::REVERSE;
 			}
+			case 4: {
+				return dtool::renamer::Core::ReorderMethod::SORT_BY_NATURAL_NAME;
+			}
+			case 5: {
+				return dtool::renamer::Core::ReorderMethod::SORT_BY_EXTENSION;
+			}
+			case 6: {
+				return dtool::renamer::Core::ReorderMethod::SORT_BY_SIZE;
+			}
+			case 7: {
+				return dtool::renamer::Core::ReorderMethod::SORT_BY_CHANGED_TIME;
+			}
 			default: {
 				break;
 			}
 		}
+		return std::nullopt;
+	}
+
+	template <typename GetterT> auto reorderHandler(GetterT& getter) -> dtool::renamer::Core::Action {
+		standardOutput(
+			"Available sort methods:\n"
+			"  (1)  Sort by name\n"
+			"  (2)  Sort by last modifed time\n"
+			"  (3)  Reverse\n"
+			"  (4)  Sort by name with numbers in their numeric order\n"
+			"  (5)  Sort by extension\n"
+			"  (6)  Sort by size\n"
+			"  (7)  Sort by last status change time\n"
+			"  (8)  Sort by multiple keys\n"
+			"Select a reorder method: "
+		);
+		int choice;
+		getter(choice);
+		if (choice == 8) {
+			standardOutput(
+				"Sort keys are name(n), natural name(N), extension(e), size(s),\n"
+				"modified time(m) and changed time(c). Prefix a key with '-' to\n"
+				"sort descending.\n"
+				"Input sort keys separated by ',' with the most significant first: "
+			);
+			std::string rawKeys;
+			getter(rawKeys);
+			try {
+				return parseSortKeys(rawKeys);
+			} catch (std::invalid_argument const& exception) {
+				standardOutputError(exception.what(), "\n");
+			}
+		} else if (auto reorderMethod = reorderMethodOf(choice)) {
+			return *reorderMethod;
+		}
 		return dtool::renamer::Core::NO_OP;
 	}
 
@@ -170,7 +257,8 @@ namespace {
 	template <typename GetterT> auto actionHandler(
 		dtool::renamer::Pattern const& pattern, dtool::renamer::Core::Previews const& previews, GetterT getter
 	) -> dtool::renamer::Core::Action {
-		displayPreviews(pattern, previews);
+		auto report = dtool::renamer::commit::validate(previews);
+		displayPreviews(pattern, previews, report);
 		standardOutput("Choose an action <pattern(p)/insert(i)/exclude(e)/reorder(r)/swap(s)/confirm(c)/abort(a)>: ");
 		std::string input;
 		getter(input);
@@ -188,6 +276,15 @@ namespace {
 		} else if (input == "s" || input == "swap") {
 			return swapHandler(previews.size(), getter);
 		} else if (input == "c" || input == "confirm") {
+			if (!report.problems.empty()) {
+				standardOutputError("Cannot confirm with problems listed above.\n");
+				return dtool::renamer::Core::NO_OP;
+			}
+			// Files might have changed while waiting for input, in which case the refreshed report is shown again.
+			if (!dtool::renamer::commit::validate(previews).problems.empty()) {
+				standardOutputError("Files have changed, and problems must be solved before confirming.\n");
+				return dtool::renamer::Core::NO_OP;
+			}
 			return dtool::renamer::Core::DoneChoice::CONFIRM;
 		} else if (input == "a" || input == "abort") {
 			return dtool::renamer::Core::DoneChoice::ABORT;
@@ -195,29 +292,249 @@ namespace {
 		return dtool::renamer::Core::NO_OP;
 	}
 
-	auto goQuiet(dtool::renamer::Core::Paths const& paths, char* const* arguments, size_t leftOver) {
-		if (leftOver <= 0) {
-			standardOutputWarning("No command received.");
+	class BadScript: public std::runtime_error {
+		public: BadScript(std::string const& message): std::runtime_error(message) {
+		}
+	};
+
+	// Splits a script into tokens separated by whitespaces. A token might be quoted with '"' to contain whitespaces,
+	// where '\' escapes the next character. Anything from a '#' starting a token to the end of line is ignored.
+	auto tokenize(std::istream& in) -> std::vector<std::string> {
+		std::vector<std::string> result;
+		for (char character; in.get(character); ) {
+			if (std::isspace(static_cast<unsigned char>(character))) {
+				continue;
+			}
+			if (character == '#') {
+				in.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+				continue;
+			}
+			std::string token;
+			if (character == '"') {
+				bool closed = false;
+				while (in.get(character)) {
+					if (character == '"') {
+						closed = true;
+						break;
+					}
+					if (character == '\\' && !in.get(character)) {
+						break;
+					}
+					token.push_back(character);
+				}
+				if (!closed) {
+					throw BadScript("Quote not closed.");
+				}
+			} else {
+				for (token.push_back(character); in.get(character); token.push_back(character)) {
+					if (std::isspace(static_cast<unsigned char>(character))) {
+						break;
+					}
+				}
+			}
+			result.push_back(std::move(token));
+		}
+		return result;
+	}
+
+	// Parses the whole command stream into actions before any of them is taken, so that a bad script is rejected
+	// without touching the filesystem. Indices are checked against the count of files expected at that point. Which
+	// file an exclusion removes is only known when it is played, so after one a path inserted again is counted as
+	// added, and indices are checked again while playing.
+	class ScriptParser {
+		public: using Self = ScriptParser;
+		private: std::vector<std::string> const& m_tokens;
+		private: std::size_t m_position = 0;
+		private: std::size_t m_command = 0;
+		private: dtool::renamer::Core::Paths m_paths;
+		private: std::size_t m_previewCount;
+		private: bool m_excluded = false;
+		public: ScriptParser(
+			std::vector<std::string> const& tokens, std::vector<std::filesystem::path> const& uniformedPaths
+		): m_tokens(tokens) {
+			for (auto const& uniformedPath: uniformedPaths) {
+				if (!uniformedPath.empty()) {
+					this->m_paths.insert(uniformedPath);
+				}
+			}
+			this->m_previewCount = this->m_paths.size();
+		}
+		public: auto parse() -> std::vector<dtool::renamer::Core::Action> {
+			std::vector<dtool::renamer::Core::Action> result;
+			while (this->m_position < this->m_tokens.size()) {
+				++this->m_command;
+				result.push_back(this->parseCommand());
+			}
+			return result;
+		}
+		private: auto fail(std::string const& message) const -> BadScript {
+			return BadScript("Command " + std::to_string(this->m_command) + ": " + message);
+		}
+		private: auto next() -> std::string const& {
+			if (this->m_position >= this->m_tokens.size()) {
+				throw this->fail("Missing argument.");
+			}
+			return this->m_tokens[this->m_position++];
+		}
+		private: auto nextIndex() -> dtool::renamer::ItemIndex {
+			auto const& token = this->next();
+			std::size_t index;
+			std::istringstream in(token);
+			if (!(in >> index) || !in.eof() || index <= 0 || index > this->m_previewCount) {
+				throw this->fail("Index '" + token + "' out of range.");
+			}
+			return dtool::renamer::ItemIndex(index);
+		}
+		private: auto parseCommand() -> dtool::renamer::Core::Action {
+			auto const& command = this->next();
+			if (command == "p" || command == "pattern") {
+				try {
+					return dtool::renamer::Pattern(this->next());
+				} catch (dtool::renamer::BadPattern const& exception) {
+					throw this->fail(exception.what());
+				}
+			} else if (command == "r" || command == "reorder") {
+				auto const& token = this->next();
+				int choice = 0;
+				std::istringstream(token) >> choice;
+				if (choice == 8) {
+					try {
+						return parseSortKeys(this->next());
+					} catch (std::invalid_argument const& exception) {
+						throw this->fail(exception.what());
+					}
+				}
+				if (auto reorderMethod = reorderMethodOf(choice)) {
+					return *reorderMethod;
+				}
+				throw this->fail("Unknown reorder method '" + token + "'.");
+			} else if (command == "i" || command == "insert") {
+				std::filesystem::path path(this->next());
+				auto uniformedPath = std::move(dtool::renamer::Core::uniform({ path }).front());
+				if (!uniformedPath.empty() && (this->m_paths.insert(std::move(uniformedPath)).second || this->m_excluded)) {
+					++this->m_previewCount;
+				}
+				return dtool::renamer::Core::AddInfo { std::move(path) };
+			} else if (command == "e" || command == "exclude") {
+				auto index = this->nextIndex();
+				--this->m_previewCount;
+				this->m_excluded = true;
+				return dtool::renamer::Core::RemoveInfo { index };
+			} else if (command == "s" || command == "swap") {
+				auto left = this->nextIndex();
+				auto right = this->nextIndex();
+				return dtool::renamer::Core::SwapInfo { left, right };
+			} else if (command == "c" || command == "confirm") {
+				return dtool::renamer::Core::DoneChoice::CONFIRM;
+			} else if (command == "a" || command == "abort") {
+				return dtool::renamer::Core::DoneChoice::ABORT;
+			}
+			throw this->fail("Unknown command '" + command + "'.");
+		}
+	};
+
+	auto goScript(std::vector<std::filesystem::path> const& paths, std::vector<std::string> const& tokens) -> int {
+		if (tokens.empty()) {
+			standardOutputWarning("No command received.\n");
 		}
 		g_quiet = true;
-		dtool::renamer::Core renamer([input = std::deque<char const*>(arguments, arguments + leftOver)](
-			dtool::renamer::Pattern const& pattern, dtool::renamer::Core::Previews const& previews
-		) mutable -> dtool::renamer::Core::Action {
-			if (input.empty()) {
+		std::vector<dtool::renamer::Core::Action> actions;
+		std::size_t position = 0;
+		bool failed = false;
+		dtool::renamer::Core renamer([&actions, &position, &failed](
+			dtool::renamer::Pattern const&, dtool::renamer::Core::Previews const& previews
+		) -> dtool::renamer::Core::Action {
+			if (position >= actions.size()) {
 				return dtool::renamer::Core::DoneChoice::CONFIRM;
 			}
-			return actionHandler(pattern, previews, [&input](auto& output) -> void {
-				std::istringstream(std::string(input.front())) >> output;
-				input.pop_front();
+			auto isInRange = [&previews](dtool::renamer::ItemIndex index) -> bool {
+				return index.underlyingIndex() < previews.size();
+			};
+			auto& action = actions[position++];
+			auto const* swapInfo = std::get_if<dtool::renamer::Core::SwapInfo>(&action);
+			auto const* removeInfo = std::get_if<dtool::renamer::Core::RemoveInfo>(&action);
+			if ((swapInfo && !(isInRange(swapInfo->left) && isInRange(swapInfo->right))) || (removeInfo && !isInRange(removeInfo->index))) {
+				standardOutputError("Command ", position, ": Index out of range.\n");
+				failed = true;
+				return dtool::renamer::Core::DoneChoice::ABORT;
+			}
+			return std::move(action);
+		}, g_commitOptions);
+		try {
+			auto uniformedPaths = dtool::renamer::Core::uniform(paths);
+			actions = ScriptParser(tokens, uniformedPaths).parse();
+			renamer.insert(uniformedPaths);
+		} catch (BadScript const& exception) {
+			standardOutputError(exception.what(), "\n");
+			return 1;
+		}
+		try {
+			renamer.interact();
+		} catch (dtool::renamer::BadCommit const& exception) {
+			standardOutputError(exception.what(), "\n");
+			return 1;
+		} catch (std::filesystem::filesystem_error const& exception) {
+			standardOutputError(exception.what(), "\n");
+			return 1;
+		}
+		return failed ? 1 : 0;
+	}
+
+	auto goScriptFile(std::vector<std::filesystem::path> const& paths, char const* scriptPath) -> int {
+		std::vector<std::string> tokens;
+		try {
+			using namespace std::literals::string_literals;
+			if (scriptPath == "-"s) {
+				tokens = tokenize(std::cin);
+			} else {
+				std::ifstream in(scriptPath);
+				if (!in) {
+					standardOutputError("Cannot open script '"s + scriptPath + "'.\n");
+					return 1;
+				}
+				tokens = tokenize(in);
+			}
+		} catch (BadScript const& exception) {
+			standardOutputError(exception.what(), "\n");
+			return 1;
+		}
+		return goScript(paths, tokens);
+	}
+
+	auto goWatch(char const* directory, char const* rawPattern) -> int {
+		try {
+			dtool::renamer::Watcher::Options options;
+			options.commitOptions = g_commitOptions;
+			dtool::renamer::Watcher watcher(directory, dtool::renamer::Pattern(rawPattern), options);
+			standardOutput("Watching ", directory, ", next index is ", watcher.counter() + 1, ".\n");
+			watcher.run([](dtool::renamer::Core::Previews const& previews, std::exception_ptr error) -> bool {
+				if (error) {
+					try {
+						std::rethrow_exception(error);
+					} catch (std::exception const& exception) {
+						standardOutputError(exception.what(), "\n");
+					}
+					return true;
+				}
+				for (auto const& preview: previews) {
+					standardOutput(preview.origin->filename().string(), " -> ", preview.newName, "\n");
+				}
+				return true;
 			});
-		});
-		renamer.interact(paths);
+		} catch (dtool::renamer::BadPattern const& exception) {
+			standardOutputError(exception.what(), "\n");
+			return 1;
+		} catch (std::exception const& exception) {
+			standardOutputError(exception.what(), "\n");
+			return 1;
+		}
+		return 0;
 	}
 } // namespace
 
 int main(int argc, char** argv) {
 	ConsoleGuard guard;
-	dtool::renamer::Core::Paths paths;
+	std::vector<std::filesystem::path> paths;
 	for (int i = 1; i < argc; ++i) {
 		using namespace std::literals::string_literals;
 		if (argv[i] == "-v"s || argv[i] == "--version"s) {
@@ -239,6 +556,21 @@ int main(int argc, char** argv) {
 				"    interactive mode. A 'confirm' command will be automatically\n"
 				"    appended. Use interactive mode to see available commands.\n"
 				"\n"
+				"  -f|--file <script>\n"
+				"    Like '-c', but read the commands from the script, or from\n"
+				"    the standard input if the script is '-'. Commands are\n"
+				"    separated by whitespaces, and might be quoted with '\"'.\n"
+				"    Anything after a '#' starting a command is a comment.\n"
+				"\n"
+				"  --io-uring <queue depth>\n"
+				"    Rename with io_uring if available, keeping at most the given\n"
+				"    number of renames in flight. Must precede other options.\n"
+				"\n"
+				"  -w|--watch <directory> <pattern>\n"
+				"    Keep running and rename files arriving in the directory in\n"
+				"    batches with the pattern. The file index continues from the\n"
+				"    counter persisted in '.drename-counter' of the directory.\n"
+				"\n"
 				"Pattern is a customizable string which may contain format\n"
 				"operators surrounded with braces('{}'). Available operators are:\n"
 				"  o\n"
@@ -257,14 +589,49 @@ int main(int argc, char** argv) {
 				"    Writes the nth character in the character sequence, where n\n"
 				"    is the remainder of the file index divided by the length of\n"
 				"    the character sequence.\n"
+				"\n"
+				"A generated name may contain '/' to move the file into another\n"
+				"directory relative to its current one. Missing directories are\n"
+				"created. Moving across devices falls back to copying.\n"
+				"\n"
+				"New names are checked before anything is renamed. Empty names,\n"
+				"names with empty, '.' or '..' components, names too long,\n"
+				"names used twice and names of existing files are rejected.\n"
 			);
 			return 0;
 		}
 		if (argv[i] == "-c"s || argv[i] == "--commands"s) {
-			goQuiet(paths, argv + i + 1, argc - i - 1);
-			return 0;
+			return goScript(paths, std::vector<std::string>(argv + i + 1, argv + argc));
+		}
+		if (argv[i] == "-f"s || argv[i] == "--file"s) {
+			if (i + 1 >= argc) {
+				standardOutputError("A script is required.\n");
+				return 1;
+			}
+			return goScriptFile(paths, argv[i + 1]);
 		}
-		paths.insert(std::filesystem::path(argv[i]));
+		if (argv[i] == "--io-uring"s) {
+			unsigned queueDepth = 0;
+			if (i + 1 >= argc || !(std::istringstream(argv[i + 1]) >> queueDepth) || queueDepth == 0) {
+				standardOutputError("A positive queue depth is required for io_uring.\n");
+				return 1;
+			}
+			if (!dtool::renamer::commit::isIoUringAvailable(queueDepth)) {
+				standardOutputWarning("io_uring is not available with queue depth ", queueDepth, ", renaming synchronously.\n");
+			}
+			g_commitOptions.backend = dtool::renamer::commit::Backend::IO_URING;
+			g_commitOptions.queueDepth = queueDepth;
+			++i;
+			continue;
+		}
+		if (argv[i] == "-w"s || argv[i] == "--watch"s) {
+			if (argc - i - 1 < 2) {
+				standardOutputError("A directory and a pattern are required to watch.\n");
+				return 1;
+			}
+			return goWatch(argv[i + 1], argv[i + 2]);
+		}
+		paths.emplace_back(argv[i]);
 	}
 	dtool::renamer::Core renamer([](
 		dtool::renamer::Pattern const& pattern, dtool::renamer::Core::Previews const& previews
@@ -272,8 +639,17 @@ int main(int argc, char** argv) {
 		return actionHandler(pattern, previews, [](auto& output) -> void {
 			std::cin >> output;
 		});
-	});
+	}, g_commitOptions);
 	standardOutputWarning("CLI of drename is not yet stable.\n");
-	renamer.interact(paths);
+	renamer.insert(paths);
+	try {
+		renamer.interact();
+	} catch (dtool::renamer::BadCommit const& exception) {
+		standardOutputError(exception.what(), "\n");
+		return 1;
+	} catch (std::filesystem::filesystem_error const& exception) {
+		standardOutputError(exception.what(), "\n");
+		return 1;
+	}
 	return 0;
 }
@@ -0,0 +1,567 @@
+#include <dtool/renamer.hpp>
+
+#if defined(__linux__)
+#	include <fcntl.h>
+#	include <unistd.h>
+#	include <sys/ioctl.h>
+#	include <sys/stat.h>
+#	include <linux/fs.h>
+#	if __has_include(<linux/io_uring.h>)
+#		include <linux/io_uring.h>
+#	endif
+// Renaming and creating directories through io_uring needs a kernel header of 5.15 or later, and
+// `IORING_FEAT_CQE_SKIP` only appears in such headers.
+#	if defined(IORING_FEAT_CQE_SKIP)
+#		define DTOOL_RENAMER_IO_URING 1
+#		include <sys/mman.h>
+#		include <sys/syscall.h>
+#	endif
+#endif
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <iterator>
+#include <limits>
+#include <string>
+#include <vector>
+#include <set>
+#include <unordered_map>
+#include <unordered_set>
+#include <filesystem>
+#include <system_error>
+#include <memory>
+
+namespace dtool::renamer::commit {
+	namespace {
+		constexpr auto NONE = std::numeric_limits<std::size_t>::max();
+
+		// Remembers directories known to exist so that a batch touching the same folders many times only probes
+		// and creates each of them once.
+		class DirectoryCache {
+			public: using Self = DirectoryCache;
+			private: std::unordered_set<std::string> m_known;
+			// Appends missing ancestors of `directory` and itself to `missing` in the order they should be created,
+			// and treats them as existing from now on.
+			public: auto collectMissing(std::filesystem::path const& directory, std::vector<std::filesystem::path>& missing) -> void {
+				if (directory.empty() || this->m_known.count(directory.native()) > 0) {
+					return;
+				}
+				auto oldSize = missing.size();
+				for (auto current = directory; !current.empty(); current = current.parent_path()) {
+					if (this->m_known.count(current.native()) > 0) {
+						break;
+					}
+					std::error_code errorCode;
+					auto status = std::filesystem::status(current, errorCode);
+					if (std::filesystem::exists(status)) {
+						if (!std::filesystem::is_directory(status)) {
+							throw std::filesystem::filesystem_error(
+								"Not a directory", current, std::make_error_code(std::errc::not_a_directory)
+							);
+						}
+						this->m_known.insert(current.native());
+						break;
+					}
+					missing.push_back(current);
+					this->m_known.insert(current.native());
+					if (current == current.root_path()) {
+						break;
+					}
+				}
+				std::reverse(missing.begin() + oldSize, missing.end());
+			}
+			public: auto ensure(std::filesystem::path const& directory) -> void {
+				std::vector<std::filesystem::path> missing;
+				this->collectMissing(directory, missing);
+				for (auto const& current: missing) {
+					std::filesystem::create_directory(current);
+				}
+			}
+		};
+
+		// Returns a free temporary path in the directory of `origin`. The name does not embed the original one, so that
+		// it is not longer than the longest valid name. `next` is shared by all calls for a plan, so that temporary
+		// paths chosen before but not yet created are not chosen again.
+		auto temporaryPath(
+			std::filesystem::path const& origin, std::unordered_map<std::string, std::size_t> const& sources,
+			std::unordered_map<std::string, std::size_t> const& targets, std::size_t& next
+		) -> std::filesystem::path {
+			for (; ; ) {
+				auto result = origin.parent_path() / (".drename-" + std::to_string(next++));
+				std::error_code errorCode;
+				if (
+					sources.count(result.native()) == 0 && targets.count(result.native()) == 0 &&
+					!std::filesystem::exists(std::filesystem::symlink_status(result, errorCode))
+				) {
+					return result;
+				}
+			}
+		}
+
+#if defined(__linux__)
+		struct FileDescriptor {
+			public: using Self = FileDescriptor;
+			public: int value;
+			public: FileDescriptor(int descriptor) noexcept: value(descriptor) {
+			}
+			public: FileDescriptor(Self const&) = delete;
+			public: auto operator =(Self const&) -> Self& = delete;
+			public: ~FileDescriptor() noexcept {
+				if (this->value >= 0) {
+					::close(this->value);
+				}
+			}
+		};
+
+		auto lastError() -> std::error_code {
+			return std::error_code(errno, std::generic_category());
+		}
+
+		// Clones the file when the filesystems support reflinks, otherwise lets the kernel copy the data without a
+		// round trip through user space. Falls back to the portable copy only if neither is possible. The source is
+		// opened without blocking, in case it has been replaced by a FIFO.
+		auto copyRegularFile(std::filesystem::path const& from, std::filesystem::path const& to) -> void {
+			FileDescriptor source(::open(from.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC));
+			if (source.value < 0) {
+				throw std::filesystem::filesystem_error("Cannot open source", from, lastError());
+			}
+			struct stat sourceStatus;
+			if (::fstat(source.value, &sourceStatus) != 0) {
+				throw std::filesystem::filesystem_error("Cannot stat source", from, lastError());
+			}
+			if (!S_ISREG(sourceStatus.st_mode)) {
+				throw std::filesystem::filesystem_error(
+					"Cannot move special file across devices", from, to, std::make_error_code(std::errc::operation_not_supported)
+				);
+			}
+			FileDescriptor target(::open(to.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, sourceStatus.st_mode & 07777));
+			if (target.value < 0) {
+				throw std::filesystem::filesystem_error("Cannot open target", to, lastError());
+			}
+			bool copied = ::ioctl(target.value, FICLONE, source.value) == 0;
+			for (off_t left = sourceStatus.st_size; !copied; ) {
+				auto written = ::copy_file_range(source.value, nullptr, target.value, nullptr, static_cast<std::size_t>(left), 0);
+				if (written < 0) {
+					if (left == sourceStatus.st_size && (errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP || errno == EINVAL)) {
+						break;
+					}
+					auto errorCode = lastError();
+					std::filesystem::remove(to);
+					throw std::filesystem::filesystem_error("Cannot copy", from, to, errorCode);
+				}
+				left -= written;
+				copied = written == 0 || left <= 0;
+			}
+			if (!copied) {
+				std::filesystem::copy_file(from, to, std::filesystem::copy_options::overwrite_existing);
+			}
+			// The mode given to `open` is reduced by the umask. The owner is kept where permitted, before the mode,
+			// as changing the owner clears set-user-ID and set-group-ID bits.
+			static_cast<void>(::fchown(target.value, sourceStatus.st_uid, sourceStatus.st_gid));
+			if (::fchmod(target.value, sourceStatus.st_mode & 07777) != 0) {
+				auto errorCode = lastError();
+				std::filesystem::remove(to);
+				throw std::filesystem::filesystem_error("Cannot set permissions", to, errorCode);
+			}
+			struct timespec const times[2] = { sourceStatus.st_atim, sourceStatus.st_mtim };
+			::futimens(target.value, times);
+		}
+#else
+		auto copyRegularFile(std::filesystem::path const& from, std::filesystem::path const& to) -> void {
+			std::filesystem::copy_file(from, to, std::filesystem::copy_options::overwrite_existing);
+			std::filesystem::last_write_time(to, std::filesystem::last_write_time(from));
+		}
+#endif
+
+#if defined(DTOOL_RENAMER_IO_URING)
+		// A minimal io_uring wrapper over the raw system calls.
+		class Ring {
+			public: using Self = Ring;
+			private: int m_descriptor = -1;
+			private: io_uring_params m_parameters;
+			private: void* m_submissionRing = MAP_FAILED;
+			private: std::size_t m_submissionRingSize = 0;
+			private: void* m_completionRing = MAP_FAILED;
+			private: std::size_t m_completionRingSize = 0;
+			private: io_uring_sqe* m_submissions = nullptr;
+			private: std::size_t m_submissionsSize = 0;
+			private: unsigned m_pending = 0;
+			public: explicit Ring(unsigned depth) {
+				std::memset(&this->m_parameters, 0, sizeof(this->m_parameters));
+				// Depths above the limit of the kernel are lowered to it rather than rejected.
+				this->m_parameters.flags = IORING_SETUP_CLAMP;
+				this->m_descriptor = static_cast<int>(::syscall(__NR_io_uring_setup, std::max(depth, 1u), &this->m_parameters));
+				if (this->m_descriptor < 0) {
+					throw std::system_error(errno, std::generic_category(), "Cannot set up io_uring");
+				}
+				auto const& parameters = this->m_parameters;
+				this->m_submissionRingSize = parameters.sq_off.array + parameters.sq_entries * sizeof(unsigned);
+				this->m_completionRingSize = parameters.cq_off.cqes + parameters.cq_entries * sizeof(io_uring_cqe);
+				bool singleMap = (parameters.features & IORING_FEAT_SINGLE_MMAP) != 0;
+				if (singleMap) {
+					this->m_submissionRingSize = std::max(this->m_submissionRingSize, this->m_completionRingSize);
+				}
+				// The destructor is not called if the constructor throws, so whatever has been set up is released here.
+				try {
+					this->m_submissionRing = this->map(this->m_submissionRingSize, IORING_OFF_SQ_RING);
+					if (singleMap) {
+						this->m_completionRing = this->m_submissionRing;
+					} else {
+						this->m_completionRing = this->map(this->m_completionRingSize, IORING_OFF_CQ_RING);
+					}
+					this->m_submissionsSize = parameters.sq_entries * sizeof(io_uring_sqe);
+					this->m_submissions = static_cast<io_uring_sqe*>(this->map(this->m_submissionsSize, IORING_OFF_SQES));
+				} catch (...) {
+					this->release();
+					throw;
+				}
+			}
+			public: Ring(Self const&) = delete;
+			public: auto operator =(Self const&) -> Self& = delete;
+			public: ~Ring() noexcept {
+				this->release();
+			}
+			public: auto depth() const noexcept -> unsigned {
+				return this->m_parameters.sq_entries;
+			}
+			// Returns the count of prepared entries which have not been submitted yet.
+			public: auto pending() const noexcept -> unsigned {
+				return this->m_pending;
+			}
+			// Returns a cleared submission queue entry which will be submitted by the next call to `submit`.
+			public: auto prepare() noexcept -> io_uring_sqe* {
+				auto const& offsets = this->m_parameters.sq_off;
+				auto* tail = this->field<unsigned>(this->m_submissionRing, offsets.tail);
+				auto index = *tail & *(this->field<unsigned>(this->m_submissionRing, offsets.ring_mask));
+				auto* entry = this->m_submissions + index;
+				std::memset(entry, 0, sizeof(io_uring_sqe));
+				this->field<unsigned>(this->m_submissionRing, offsets.array)[index] = index;
+				__atomic_store_n(tail, *tail + 1, __ATOMIC_RELEASE);
+				++this->m_pending;
+				return entry;
+			}
+			public: auto submit(unsigned waitCount) -> void {
+				for (; ; ) {
+					auto submitted = ::syscall(
+						__NR_io_uring_enter, this->m_descriptor, this->m_pending, waitCount, IORING_ENTER_GETEVENTS, nullptr, 0
+					);
+					if (submitted >= 0) {
+						this->m_pending -= static_cast<unsigned>(submitted);
+						return;
+					}
+					if (errno != EINTR) {
+						throw std::system_error(errno, std::generic_category(), "Cannot submit to io_uring");
+					}
+				}
+			}
+			// Waits until at least `count` completions are available without submitting anything, and returns whether
+			// waiting succeeded.
+			public: auto wait(unsigned count) noexcept -> bool {
+				for (; ; ) {
+					if (::syscall(__NR_io_uring_enter, this->m_descriptor, 0, count, IORING_ENTER_GETEVENTS, nullptr, 0) >= 0) {
+						return true;
+					}
+					if (errno != EINTR) {
+						return false;
+					}
+				}
+			}
+			// Calls `function(userData, result)` for each completion, and returns their count.
+			public: template <typename FunctionT> auto reap(FunctionT const& function) -> unsigned {
+				auto const& offsets = this->m_parameters.cq_off;
+				auto* head = this->field<unsigned>(this->m_completionRing, offsets.head);
+				auto tail = __atomic_load_n(this->field<unsigned>(this->m_completionRing, offsets.tail), __ATOMIC_ACQUIRE);
+				auto mask = *(this->field<unsigned>(this->m_completionRing, offsets.ring_mask));
+				auto* completions = this->field<io_uring_cqe>(this->m_completionRing, offsets.cqes);
+				unsigned count = 0;
+				for (auto current = *head; current != tail; ++current, ++count) {
+					function(completions[current & mask].user_data, completions[current & mask].res);
+				}
+				__atomic_store_n(head, tail, __ATOMIC_RELEASE);
+				return count;
+			}
+			private: auto release() noexcept -> void {
+				if (this->m_submissions != nullptr) {
+					::munmap(this->m_submissions, this->m_submissionsSize);
+				}
+				if (this->m_completionRing != MAP_FAILED && this->m_completionRing != this->m_submissionRing) {
+					::munmap(this->m_completionRing, this->m_completionRingSize);
+				}
+				if (this->m_submissionRing != MAP_FAILED) {
+					::munmap(this->m_submissionRing, this->m_submissionRingSize);
+				}
+				::close(this->m_descriptor);
+			}
+			private: auto map(std::size_t size, unsigned long long offset) -> void* {
+				auto* result = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, this->m_descriptor, offset);
+				if (result == MAP_FAILED) {
+					throw std::system_error(errno, std::generic_category(), "Cannot map io_uring");
+				}
+				return result;
+			}
+			private: template <typename T> static auto field(void* ring, unsigned offset) noexcept -> T* {
+				return reinterpret_cast<T*>(static_cast<char*>(ring) + offset);
+			}
+		};
+
+		// Runs one operation per item, keeping at most the depth of `ring` in flight. Items of a level start only
+		// after all items of lower levels have completed, and then `finish(item, result)` is called for each of them
+		// in order, where `result` is zero or a negated error number. On failure, operations already submitted are
+		// waited for before the exception leaves.
+		template <typename PrepareT, typename FinishT> auto runInLevels(
+			Ring& ring, std::vector<std::size_t> const& levels, PrepareT const& prepare, FinishT const& finish
+		) -> void {
+			std::vector<std::size_t> order(levels.size());
+			for (std::size_t i = 0; i < order.size(); ++i) {
+				order[i] = i;
+			}
+			std::stable_sort(order.begin(), order.end(), [&levels](std::size_t left, std::size_t right) -> bool {
+				return levels[left] < levels[right];
+			});
+			std::vector<int> results(levels.size());
+			unsigned inFlight = 0;
+			auto collect = [&results, &inFlight](std::uint64_t item, int result) -> void {
+				results[item] = result;
+				--inFlight;
+			};
+			for (auto begin = order.begin(); begin != order.end(); ) {
+				auto end = std::find_if(begin, order.end(), [&levels, level = levels[*begin]](std::size_t item) -> bool {
+					return levels[item] != level;
+				});
+				try {
+					for (auto current = begin; current != end; ++current) {
+						for (; inFlight >= ring.depth(); ring.reap(collect)) {
+							ring.submit(1);
+						}
+						auto* entry = ring.prepare();
+						prepare(entry, *current);
+						entry->user_data = *current;
+						++inFlight;
+					}
+					for (ring.submit(0); inFlight > 0; ring.reap(collect)) {
+						ring.submit(inFlight);
+					}
+				} catch (...) {
+					// Entries never submitted will not complete. If even waiting fails, nothing more can be done.
+					for (inFlight -= ring.pending(); inFlight > 0 && ring.wait(1); ring.reap(collect)) {
+					}
+					throw;
+				}
+				for (auto current = begin; current != end; ++current) {
+					finish(*current, results[*current]);
+				}
+				begin = end;
+			}
+		}
+
+		// Levels of moves such that each move only depends on moves of lower levels: those freeing its target and
+		// the one producing its source, which are both earlier in the plan.
+		auto moveLevels(std::vector<Move> const& moves) -> std::vector<std::size_t> {
+			std::vector<std::size_t> result(moves.size(), 0);
+			std::unordered_map<std::string, std::size_t> freed;
+			std::unordered_map<std::string, std::size_t> produced;
+			for (std::size_t i = 0; i < moves.size(); ++i) {
+				if (auto found = freed.find(moves[i].to.native()); found != freed.end()) {
+					result[i] = std::max(result[i], found->second + 1);
+				}
+				if (auto found = produced.find(moves[i].from.native()); found != produced.end()) {
+					result[i] = std::max(result[i], found->second + 1);
+				}
+				freed[moves[i].from.native()] = result[i];
+				produced[moves[i].to.native()] = result[i];
+			}
+			return result;
+		}
+
+		auto isUnsupported(int result) -> bool {
+			return result == -EINVAL || result == -EOPNOTSUPP || result == -ENOSYS;
+		}
+
+		auto executeWithRing(Plan const& plan, Options const& options) -> bool {
+			std::unique_ptr<Ring> ring;
+			try {
+				ring = std::make_unique<Ring>(options.queueDepth);
+			} catch (std::system_error const&) {
+				return false;
+			}
+			DirectoryCache cache;
+			std::vector<std::filesystem::path> missing;
+			for (auto const& directory: plan.directories) {
+				cache.collectMissing(directory, missing);
+			}
+			std::vector<std::size_t> directoryLevels;
+			for (auto const& directory: missing) {
+				directoryLevels.push_back(static_cast<std::size_t>(std::distance(directory.begin(), directory.end())));
+			}
+			runInLevels(*ring, directoryLevels, [&missing](io_uring_sqe* entry, std::size_t item) -> void {
+				entry->opcode = IORING_OP_MKDIRAT;
+				entry->fd = AT_FDCWD;
+				entry->addr = reinterpret_cast<std::uintptr_t>(missing[item].c_str());
+				entry->len = 0777;
+			}, [&missing](std::size_t item, int result) -> void {
+				if (isUnsupported(result)) {
+					std::filesystem::create_directory(missing[item]);
+				} else if (result < 0 && result != -EEXIST) {
+					throw std::filesystem::filesystem_error(
+						"Cannot create directory", missing[item], std::error_code(-result, std::generic_category())
+					);
+				}
+			});
+			runInLevels(*ring, moveLevels(plan.moves), [&plan](io_uring_sqe* entry, std::size_t item) -> void {
+				entry->opcode = IORING_OP_RENAMEAT;
+				entry->fd = AT_FDCWD;
+				entry->addr = reinterpret_cast<std::uintptr_t>(plan.moves[item].from.c_str());
+				entry->len = static_cast<unsigned>(AT_FDCWD);
+				entry->addr2 = reinterpret_cast<std::uintptr_t>(plan.moves[item].to.c_str());
+			}, [&plan](std::size_t item, int result) -> void {
+				auto const& move = plan.moves[item];
+				if (result == -EXDEV || isUnsupported(result)) {
+					moveFile(move.from, move.to);
+				} else if (result < 0) {
+					throw std::filesystem::filesystem_error(
+						"Cannot rename", move.from, move.to, std::error_code(-result, std::generic_category())
+					);
+				}
+			});
+			return true;
+		}
+#else
+		auto executeWithRing(Plan const& plan, Options const& options) -> bool {
+			return false;
+		}
+#endif
+	} // namespace
+
+	auto plan(Core::Previews const& previews) -> Plan {
+		if (auto report = validate(previews); !report.problems.empty()) {
+			auto const& first = report.problems.front();
+			auto message = std::to_string(report.problems.size()) + " problem(s) found, the first one is '" +
+				std::string(previews[first.index].newName) + "': " + describe(first.issue) + ".";
+			throw BadCommit(message, std::move(report));
+		}
+		Plan result;
+		std::vector<Move> moves;
+		std::unordered_map<std::string, std::size_t> sources;
+		std::unordered_map<std::string, std::size_t> targets;
+		std::set<std::filesystem::path> directories;
+		for (auto const& preview: previews) {
+			auto folder = preview.origin->parent_path();
+			auto target = (folder / preview.newName).lexically_normal();
+			if (target == *(preview.origin)) {
+				continue;
+			}
+			targets.emplace(target.native(), moves.size());
+			if (auto targetFolder = target.parent_path(); targetFolder != folder) {
+				directories.insert(std::move(targetFolder));
+			}
+			sources.emplace(preview.origin->native(), moves.size());
+			moves.push_back(Move { *(preview.origin), std::move(target) });
+		}
+		result.directories.assign(directories.begin(), directories.end());
+
+		// A move has to wait until the file occupying its target has been moved away. Since sources are unique,
+		// every move waits for at most one other, so the dependencies form chains which might close into cycles.
+		std::vector<std::size_t> blockers(moves.size(), NONE);
+		for (std::size_t i = 0; i < moves.size(); ++i) {
+			if (auto found = sources.find(moves[i].to.native()); found != sources.end() && found->second != i) {
+				blockers[i] = found->second;
+			}
+		}
+		enum class State {
+			UNVISITED,
+			VISITING,
+			DONE
+		};
+		std::vector<State> states(moves.size(), State::UNVISITED);
+		result.moves.reserve(moves.size());
+		std::vector<std::size_t> chain;
+		std::size_t nextTemporary = 0;
+		for (std::size_t i = 0; i < moves.size(); ++i) {
+			if (states[i] != State::UNVISITED) {
+				continue;
+			}
+			chain.clear();
+			auto current = i;
+			for (; current != NONE && states[current] == State::UNVISITED; current = blockers[current]) {
+				states[current] = State::VISITING;
+				chain.push_back(current);
+			}
+			if (current != NONE && states[current] == State::VISITING) {
+				// Break the cycle by parking its first file under a temporary name.
+				auto temporary = temporaryPath(moves[current].from, sources, targets, nextTemporary);
+				result.moves.push_back(Move { moves[current].from, temporary });
+				auto member = chain.rbegin();
+				for (; *member != current; ++member) {
+					result.moves.push_back(std::move(moves[*member]));
+				}
+				result.moves.push_back(Move { std::move(temporary), std::move(moves[current].to) });
+				for (++member; member != chain.rend(); ++member) {
+					result.moves.push_back(std::move(moves[*member]));
+				}
+			} else {
+				for (auto member = chain.rbegin(); member != chain.rend(); ++member) {
+					result.moves.push_back(std::move(moves[*member]));
+				}
+			}
+			for (auto member: chain) {
+				states[member] = State::DONE;
+			}
+		}
+		return result;
+	}
+
+	auto execute(Plan const& plan, Options const& options) -> void {
+		if (options.backend == Backend::IO_URING && executeWithRing(plan, options)) {
+			return;
+		}
+		DirectoryCache cache;
+		for (auto const& directory: plan.directories) {
+			cache.ensure(directory);
+		}
+		for (auto const& move: plan.moves) {
+			moveFile(move.from, move.to);
+		}
+	}
+
+	auto isIoUringAvailable(unsigned queueDepth) -> bool {
+#if defined(DTOOL_RENAMER_IO_URING)
+		try {
+			Ring ring(queueDepth);
+			return true;
+		} catch (std::system_error const&) {
+		}
+#endif
+		return false;
+	}
+
+	auto moveFile(std::filesystem::path const& from, std::filesystem::path const& to) -> void {
+		std::error_code errorCode;
+		std::filesystem::rename(from, to, errorCode);
+		if (!errorCode) {
+			return;
+		}
+		if (errorCode != std::errc::cross_device_link) {
+			throw std::filesystem::filesystem_error("Cannot rename", from, to, errorCode);
+		}
+		auto status = std::filesystem::symlink_status(from);
+		if (std::filesystem::is_symlink(status)) {
+			std::filesystem::copy_symlink(from, to);
+			std::filesystem::remove(from);
+		} else if (std::filesystem::is_directory(status)) {
+			std::filesystem::copy(
+				from, to, std::filesystem::copy_options::recursive | std::filesystem::copy_options::copy_symlinks
+			);
+			std::filesystem::remove_all(from);
+		} else if (std::filesystem::is_regular_file(status)) {
+			copyRegularFile(from, to);
+			std::filesystem::remove(from);
+		} else {
+			throw std::filesystem::filesystem_error(
+				"Cannot move special file across devices", from, to, std::make_error_code(std::errc::operation_not_supported)
+			);
+		}
+	}
+} // namespace dtool::renamer::commit
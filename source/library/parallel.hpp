@@ -0,0 +1,32 @@
+#ifndef DTOOL_LIBRARY_PARALLEL_HPP_INCLUDED
+#	define DTOOL_LIBRARY_PARALLEL_HPP_INCLUDED 1
+
+#	include <cstddef>
+#	include <algorithm>
+#	include <thread>
+#	include <vector>
+
+namespace dtool::renamer::detail {
+	// Calls `function(begin, end)` over consecutive ranges covering [0, count), on multiple threads if there are at
+	// least `grain` items for each of them.
+	template <typename FunctionT> auto parallelFor(std::size_t count, std::size_t grain, FunctionT const& function) -> void {
+		std::size_t workerCount = std::min<std::size_t>(
+			std::max(std::thread::hardware_concurrency(), 1u), (count + grain - 1) / grain
+		);
+		if (workerCount <= 1) {
+			function(std::size_t(0), count);
+			return;
+		}
+		std::vector<std::thread> workers;
+		auto share = (count + workerCount - 1) / workerCount;
+		for (std::size_t begin = share; begin < count; begin += share) {
+			workers.emplace_back(function, begin, std::min(begin + share, count));
+		}
+		function(std::size_t(0), share);
+		for (auto& worker: workers) {
+			worker.join();
+		}
+	}
+} // namespace dtool::renamer::detail
+
+#endif // ifndef DTOOL_LIBRARY_PARALLEL_HPP_INCLUDED
@@ -1,11 +1,17 @@
 #include <dtool/renamer.hpp>
 
+#include "parallel.hpp"
+
 #include <stdexcept>
 #include <string>
 #include <string_view>
 #include <variant>
 #include <filesystem>
 #include <algorithm>
+#include <unordered_map>
+#include <vector>
+#include <system_error>
+#include <utility>
 
 namespace {
 	template<class... T> struct OverloadHelper : T... { using T::operator()...; };
@@ -138,104 +144,179 @@ namespace dtool::renamer {
 		}
 	}
 
-	namespace {
-		auto regeneratePreviews(Pattern const& pattern, Core::Previews& previews) {
-			for (auto current = previews.begin(); current < previews.end(); ++current) {
-				current->newName = pattern.generate(
-					current->origin->filename().string(), ItemIndex::fromUnderlyingIndex(current - previews.begin())
-				);
+	// Resolves each distinct parent directory only once, since inputs usually share a few of them. The final component
+	// is kept as is, so a symbolic link is renamed itself rather than its target.
+	auto Core::uniform(std::vector<std::filesystem::path> const& inputPaths) -> std::vector<std::filesystem::path> {
+		std::vector<std::filesystem::path> result(inputPaths.size());
+		std::unordered_map<std::string, std::filesystem::path> parents;
+		for (std::size_t i = 0; i < inputPaths.size(); ++i) {
+			auto const& inputPath = inputPaths[i];
+			auto fileName = inputPath.filename();
+			std::error_code errorCode;
+			if (fileName.empty() || fileName == "." || fileName == "..") {
+				result[i] = std::filesystem::canonical(inputPath, errorCode);
+				continue;
+			}
+			auto parent = inputPath.parent_path();
+			auto found = parents.find(parent.native());
+			if (found == parents.end()) {
+				auto uniformedParent = std::filesystem::canonical(parent.empty() ? std::filesystem::path(".") : parent, errorCode);
+				found = parents.emplace(parent.native(), errorCode ? std::filesystem::path() : std::move(uniformedParent)).first;
+			}
+			if (!found->second.empty()) {
+				result[i] = found->second / fileName;
+			}
+		}
+		detail::parallelFor(result.size(), 4096, [&result](std::size_t begin, std::size_t end) -> void {
+			for (auto current = begin; current < end; ++current) {
+				std::error_code errorCode;
+				if (!result[current].empty() && !std::filesystem::exists(std::filesystem::symlink_status(result[current], errorCode))) {
+					result[current].clear();
+				}
+			}
+		});
+		return result;
+	}
+
+	auto Core::insert(Self::Paths const& inputPaths) -> std::size_t {
+		return this->insert(std::vector<std::filesystem::path>(inputPaths.begin(), inputPaths.end()));
+	}
+
+	auto Core::insert(std::vector<std::filesystem::path> const& inputPaths) -> std::size_t {
+		auto oldSize = this->m_previews.size();
+		for (auto& uniformedPath: Self::uniform(inputPaths)) {
+			if (uniformedPath.empty()) {
+				continue;
+			}
+			if (auto inserted = this->m_paths.insert(std::move(uniformedPath)); inserted.second) {
+				this->m_previews.push_back(Preview { inserted.first });
 			}
 		}
+		return this->m_previews.size() - oldSize;
+	}
 
-		auto insertOnePath(Core::Paths& paths, std::filesystem::path const& newPath) -> Core::Paths::iterator {
-			std::filesystem::path uniformedPath;
-			try {
-				uniformedPath = std::filesystem::canonical(newPath);
-			} catch (std::filesystem::filesystem_error) {
-				return paths.end();
-			}
-			auto insertResult = paths.insert(std::move(uniformedPath));
-			if (!insertResult.second) {
-				return paths.end();
-			}
-			return insertResult.first;
+	auto Core::memoryUsage() const -> MemoryUsage {
+		MemoryUsage result { 0, this->m_previews.capacity() * sizeof(Preview), 0 };
+		result.names = this->m_names.reservedBytes() + this->m_spareNames.reservedBytes();
+		// Estimated, assuming a red-black tree node of the path and three pointers plus a color.
+		for (auto const& path: this->m_paths) {
+			result.paths += sizeof(path) + 4 * sizeof(void*) + path.native().capacity();
 		}
-	} // namespace
+		return result;
+	}
+
+	auto Core::regenerate(Pattern const& pattern, Self::Previews::size_type from) -> void {
+		auto& previews = this->m_previews;
+		for (auto current = from; current < previews.size(); ++current) {
+			this->m_liveNameBytes -= previews[current].newName.size();
+		}
+		// Starts a new generation in the spare arena when regenerating everything, or when partial regenerations
+		// have left too much garbage behind. The previous generation is then dropped at once.
+		if (from == 0 || this->m_names.usedBytes() > 2 * this->m_liveNameBytes + NameArena::BLOCK_SIZE) {
+			from = 0;
+			this->m_liveNameBytes = 0;
+			this->m_spareNames.reset();
+			std::swap(this->m_names, this->m_spareNames);
+		}
+		std::string buffer;
+		for (auto current = from; current < previews.size(); ++current) {
+			buffer.clear();
+			pattern.generate(previews[current].origin->filename().string(), ItemIndex::fromUnderlyingIndex(current), buffer);
+			previews[current].newName = this->m_names.store(buffer);
+			this->m_liveNameBytes += buffer.size();
+		}
+	}
 
 	auto Core::interact(Pattern pattern, Self::Paths const& inputPaths) -> void {
-		Self::Previews previews;
-		Self::Paths uniformedPaths;
-		std::vector<std::string> newNames;
-		for (auto const& inputPath: inputPaths) {
-			if (auto inserted = insertOnePath(uniformedPaths, inputPath); inserted != uniformedPaths.end()) {
-				previews.push_back(Preview { inserted });
+		auto& previews = this->m_previews;
+		auto& uniformedPaths = this->m_paths;
+		struct SessionGuard {
+			Self& core;
+			~SessionGuard() noexcept {
+				core.m_previews.clear();
+				core.m_paths.clear();
+				core.m_names = NameArena();
+				core.m_spareNames = NameArena();
+				core.m_liveNameBytes = 0;
 			}
-		}
-		regeneratePreviews(pattern, previews);
+		} guard { *this };
+		this->insert(inputPaths);
+		this->regenerate(pattern);
 		for (; ; ) {
 			Action action = this->m_handler(pattern, previews);
 			if (std::visit(OverloadHelper {
 				[](decltype(Core::NO_OP)) -> bool {
 					return false;
 				},
-				[&previews = std::as_const(previews)](DoneChoice doneChoice) -> bool {
+				[this, &previews = std::as_const(previews)](DoneChoice doneChoice) -> bool {
 					if (doneChoice == DoneChoice::CONFIRM) {
-						for (auto const& preview: previews) {
-							std::filesystem::rename(*(preview.origin), preview.origin->parent_path() / preview.newName);
-						}
+						commit::execute(commit::plan(previews), this->m_commitOptions);
 					}
 					return true;
 				},
-				[&pattern, &previews](Pattern const& newPattern) -> bool {
+				[this, &pattern](Pattern const& newPattern) -> bool {
 					pattern = newPattern;
-					regeneratePreviews(pattern, previews);
+					this->regenerate(pattern);
 					return false;
 				},
-				[&pattern = std::as_const(pattern), &previews](SwapInfo const& swapInfo) -> bool {
+				[this, &pattern = std::as_const(pattern), &previews](SwapInfo const& swapInfo) -> bool {
 					std::swap(previews.at(swapInfo.left.underlyingIndex()), previews.at(swapInfo.right.underlyingIndex()));
-					regeneratePreviews(pattern, previews);
+					this->regenerate(pattern);
 					return false;
 				},
-				[&pattern = std::as_const(pattern), &previews](ReorderMethod reorderMethod) -> bool {
+				[this, &pattern = std::as_const(pattern), &previews](ReorderMethod reorderMethod) -> bool {
 					switch(reorderMethod) {
 						case Self::ReorderMethod::SORT_BY_MODIFIED_TIME: {
-							std::sort(previews.begin(), previews.end(), [](Self::Preview const& left, Self::Preview const& right) -> bool {
-								return std::filesystem::last_write_time(*(left.origin)) < std::filesystem::last_write_time(*(right.origin));
-							});
+							sortPreviews(previews, { { SortField::MODIFIED_TIME, false } });
 							break;
 						}
 						case Self::ReorderMethod::REVERSE: {
 							std::reverse(previews.begin(), previews.end());
 							break;
 						}
+						case Self::ReorderMethod::SORT_BY_NATURAL_NAME: {
+							sortPreviews(previews, { { SortField::NATURAL_NAME, false } });
+							break;
+						}
+						case Self::ReorderMethod::SORT_BY_EXTENSION: {
+							sortPreviews(previews, { { SortField::EXTENSION, false } });
+							break;
+						}
+						case Self::ReorderMethod::SORT_BY_SIZE: {
+							sortPreviews(previews, { { SortField::SIZE, false } });
+							break;
+						}
+						case Self::ReorderMethod::SORT_BY_CHANGED_TIME: {
+							sortPreviews(previews, { { SortField::CHANGED_TIME, false } });
+							break;
+						}
 						case Self::ReorderMethod::SORT_BY_NAME:
 						default: {
-							std::sort(previews.begin(), previews.end(), [](Self::Preview const& left, Self::Preview const& right) -> bool {
-								return *(left.origin) < *(right.origin);
-							});
+							sortPreviews(previews, { { SortField::NAME, false } });
 							break;
 						}
 					}
-					regeneratePreviews(pattern, previews);
+					this->regenerate(pattern);
+					return false;
+				},
+				[this, &pattern = std::as_const(pattern), &previews](SortInfo const& sortInfo) -> bool {
+					sortPreviews(previews, sortInfo.keys);
+					this->regenerate(pattern);
 					return false;
 				},
-				[&pattern = std::as_const(pattern), &previews, &uniformedPaths](AddInfo const& addInfo) -> bool {
-					if (auto inserted = insertOnePath(uniformedPaths, addInfo.path); inserted != uniformedPaths.end()) {
-						auto id = static_cast<ItemIndex>(previews.size());
-						previews.push_back(Preview { inserted, pattern.generate(inserted->filename().string(), id) });
+				[this, &pattern = std::as_const(pattern), &previews](AddInfo const& addInfo) -> bool {
+					if (this->insert(std::vector<std::filesystem::path> { addInfo.path }) > 0) {
+						this->regenerate(pattern, previews.size() - 1);
 					}
 					return false;
 				},
-				[&pattern = std::as_const(pattern), &previews, &uniformedPaths](RemoveInfo const& removeInfo) -> bool {
+				[this, &pattern = std::as_const(pattern), &previews, &uniformedPaths](RemoveInfo const& removeInfo) -> bool {
 					Self::Previews::size_type underlyingIndex = removeInfo.index.underlyingIndex();
 					if (underlyingIndex < previews.size()) {
+						this->m_liveNameBytes -= previews[underlyingIndex].newName.size();
 						uniformedPaths.erase(previews[underlyingIndex].origin);
 						previews.erase(previews.begin() + underlyingIndex);
-						for (auto current = underlyingIndex; current < previews.size(); ++current) {
-							previews[current].newName = pattern.generate(
-								previews[current].origin->filename().string(), ItemIndex::fromUnderlyingIndex(current)
-							);
-						}
+						this->regenerate(pattern, underlyingIndex);
 					}
 					return false;
 				}
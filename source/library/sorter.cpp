@@ -0,0 +1,245 @@
+#include <dtool/renamer.hpp>
+
+#include "parallel.hpp"
+
+#if defined(__linux__)
+#	include <sys/stat.h>
+#endif
+
+#include <cstddef>
+#include <cstdint>
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <numeric>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <vector>
+
+namespace dtool::renamer {
+	namespace {
+		// Every entry gets one collation key, a byte string whose lexicographical order is the requested order.
+		// Variable length fields are terminated by `TERMINATOR` and escape bytes not greater than `ESCAPE`, so no
+		// field is a prefix of another one and fields can simply be concatenated for multiple keys.
+		unsigned char constexpr TERMINATOR = 0x00;
+		unsigned char constexpr ESCAPE = 0x01;
+		unsigned char constexpr NUMBER_MARKER = '0';
+
+		struct Status {
+			std::uint64_t size = 0;
+			std::int64_t modifiedTime = 0;
+			std::int64_t changedTime = 0;
+		};
+
+#if defined(__linux__)
+		auto readStatus(std::filesystem::path const& path) -> Status {
+			struct stat result;
+			if (::stat(path.c_str(), &result) != 0 && ::lstat(path.c_str(), &result) != 0) {
+				return Status();
+			}
+			return Status {
+				static_cast<std::uint64_t>(result.st_size),
+				static_cast<std::int64_t>(result.st_mtim.tv_sec) * 1000000000 + result.st_mtim.tv_nsec,
+				static_cast<std::int64_t>(result.st_ctim.tv_sec) * 1000000000 + result.st_ctim.tv_nsec
+			};
+		}
+#else
+		auto readStatus(std::filesystem::path const& path) -> Status {
+			Status result;
+			std::error_code errorCode;
+			if (auto size = std::filesystem::file_size(path, errorCode); !errorCode) {
+				result.size = size;
+			}
+			if (auto time = std::filesystem::last_write_time(path, errorCode); !errorCode) {
+				result.modifiedTime = std::chrono::duration_cast<std::chrono::nanoseconds>(time.time_since_epoch()).count();
+			}
+			result.changedTime = result.modifiedTime;
+			return result;
+		}
+#endif
+
+		auto appendByte(std::string& key, unsigned char byte) -> void {
+			key.push_back(static_cast<char>(byte));
+		}
+
+		auto appendUnsigned(std::string& key, std::uint64_t value) -> void {
+			for (int shift = 56; shift >= 0; shift -= 8) {
+				appendByte(key, static_cast<unsigned char>(value >> shift));
+			}
+		}
+
+		auto appendSigned(std::string& key, std::int64_t value) -> void {
+			appendUnsigned(key, static_cast<std::uint64_t>(value) ^ (std::uint64_t(1) << 63));
+		}
+
+		auto isDigit(char character) -> bool {
+			return character >= '0' && character <= '9';
+		}
+
+		// Separators sort before any other character so that paths are ordered component by component. With
+		// `natural` set, a run of digits is ordered by its value: the marker is followed by the count of its
+		// significant digits and then the digits themselves.
+		auto appendText(std::string& key, std::string_view text, bool natural) -> void {
+			for (std::size_t current = 0; current < text.size(); ) {
+				auto character = static_cast<unsigned char>(text[current]);
+				if (natural && isDigit(text[current])) {
+					auto end = current;
+					for (; end < text.size() && isDigit(text[end]); ++end) {
+					}
+					for (; current + 1 < end && text[current] == '0'; ++current) {
+					}
+					appendByte(key, NUMBER_MARKER);
+					auto length = static_cast<std::uint32_t>(end - current);
+					for (int shift = 24; shift >= 0; shift -= 8) {
+						appendByte(key, static_cast<unsigned char>(length >> shift));
+					}
+					key.append(text.substr(current, end - current));
+					current = end;
+					continue;
+				}
+				if (character == '/' || character == std::filesystem::path::preferred_separator) {
+					appendByte(key, ESCAPE);
+					appendByte(key, TERMINATOR);
+				} else if (character <= ESCAPE) {
+					appendByte(key, ESCAPE);
+					appendByte(key, character + 1);
+				} else {
+					appendByte(key, character);
+				}
+				++current;
+			}
+			appendByte(key, TERMINATOR);
+		}
+
+		auto extensionOf(std::string const& name) -> std::string_view {
+			auto separatorPosition = name.find_last_of('.');
+			if (separatorPosition == std::string::npos) {
+				return std::string_view();
+			}
+			return std::string_view(name).substr(separatorPosition + 1);
+		}
+
+		auto collationKey(
+			std::filesystem::path const& path, std::vector<Core::SortKey> const& keys, bool needsStatus, std::size_t index
+		) -> std::string {
+			std::string result;
+			auto status = needsStatus ? readStatus(path) : Status();
+			for (auto const& key: keys) {
+				auto fieldBegin = result.size();
+				switch (key.field) {
+					case Core::SortField::NAME: {
+						appendText(result, path.string(), false);
+						break;
+					}
+					case Core::SortField::NATURAL_NAME: {
+						appendText(result, path.string(), true);
+						break;
+					}
+					case Core::SortField::EXTENSION: {
+						appendText(result, extensionOf(path.filename().string()), true);
+						break;
+					}
+					case Core::SortField::SIZE: {
+						appendUnsigned(result, status.size);
+						break;
+					}
+					case Core::SortField::MODIFIED_TIME: {
+						appendSigned(result, status.modifiedTime);
+						break;
+					}
+					case Core::SortField::CHANGED_TIME: {
+						appendSigned(result, status.changedTime);
+						break;
+					}
+				}
+				if (key.descending) {
+					for (auto current = result.begin() + fieldBegin; current != result.end(); ++current) {
+						*current = static_cast<char>(~static_cast<unsigned char>(*current));
+					}
+				}
+			}
+			// Keeps the sort stable, as all keys are distinct then.
+			appendUnsigned(result, index);
+			return result;
+		}
+
+		// Nesting limit of `radixSort`, past which the remaining range is sorted by comparison.
+		std::size_t constexpr MAX_RADIX_LEVEL = 16;
+
+		// Most significant digit first radix sort of `[begin, end)` by the keys they refer to, which are known to be
+		// equal before `depth`. `buffer` has the same size as the range. `level` is the current nesting.
+		auto radixSort(
+			std::vector<std::string> const& keys, std::size_t* begin, std::size_t* end, std::size_t* buffer, std::size_t depth,
+			std::size_t level
+		) -> void {
+			if (end - begin < 32 || level >= MAX_RADIX_LEVEL) {
+				std::sort(begin, end, [&keys, depth](std::size_t left, std::size_t right) -> bool {
+					return keys[left].compare(depth, std::string::npos, keys[right], depth, std::string::npos) < 0;
+				});
+				return;
+			}
+			// Skips the bytes shared by the whole range at once, as names of one directory share their long path.
+			auto const& first = keys[*begin];
+			auto common = first.size();
+			for (auto current = begin + 1; current != end && common > depth; ++current) {
+				auto const& key = keys[*current];
+				auto limit = std::min(common, key.size());
+				auto position = depth;
+				for (; position < limit && key[position] == first[position]; ++position) {
+				}
+				common = position;
+			}
+			depth = std::max(depth, common);
+			std::size_t counts[257] = {};
+			auto bucketOf = [&keys, depth](std::size_t index) -> std::size_t {
+				auto const& key = keys[index];
+				return key.size() > depth ? static_cast<unsigned char>(key[depth]) + std::size_t(1) : 0;
+			};
+			for (auto current = begin; current != end; ++current) {
+				++counts[bucketOf(*current)];
+			}
+			std::size_t offsets[257];
+			offsets[0] = 0;
+			for (std::size_t bucket = 1; bucket < 257; ++bucket) {
+				offsets[bucket] = offsets[bucket - 1] + counts[bucket - 1];
+			}
+			for (auto current = begin; current != end; ++current) {
+				buffer[offsets[bucketOf(*current)]++] = *current;
+			}
+			std::copy(buffer, buffer + (end - begin), begin);
+			// Keys in bucket 0 have ended and are equal, the others continue at the next byte.
+			for (std::size_t bucket = 1, bucketBegin = counts[0]; bucket < 257; bucketBegin += counts[bucket++]) {
+				if (counts[bucket] > 1) {
+					radixSort(keys, begin + bucketBegin, begin + bucketBegin + counts[bucket], buffer + bucketBegin, depth + 1, level + 1);
+				}
+			}
+		}
+	} // namespace
+
+	auto sortPreviews(Core::Previews& previews, std::vector<Core::SortKey> const& keys) -> void {
+		if (previews.size() < 2 || keys.empty()) {
+			return;
+		}
+		bool needsStatus = std::any_of(keys.begin(), keys.end(), [](Core::SortKey const& key) -> bool {
+			return key.field == Core::SortField::SIZE || key.field == Core::SortField::MODIFIED_TIME ||
+				key.field == Core::SortField::CHANGED_TIME;
+		});
+		std::vector<std::string> collationKeys(previews.size());
+		detail::parallelFor(previews.size(), needsStatus ? 1024 : 16384, [&](std::size_t begin, std::size_t end) -> void {
+			for (auto current = begin; current < end; ++current) {
+				collationKeys[current] = collationKey(*(previews[current].origin), keys, needsStatus, current);
+			}
+		});
+		std::vector<std::size_t> order(previews.size());
+		std::vector<std::size_t> buffer(previews.size());
+		std::iota(order.begin(), order.end(), std::size_t(0));
+		radixSort(collationKeys, order.data(), order.data() + order.size(), buffer.data(), 0, 0);
+		Core::Previews sorted;
+		sorted.reserve(previews.size());
+		for (auto index: order) {
+			sorted.push_back(std::move(previews[index]));
+		}
+		previews = std::move(sorted);
+	}
+} // namespace dtool::renamer
@@ -0,0 +1,156 @@
+#include <dtool/renamer.hpp>
+
+#include "parallel.hpp"
+
+#include <climits>
+#include <cstddef>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace dtool::renamer::commit {
+	namespace {
+#if defined(NAME_MAX)
+		std::size_t constexpr MAX_NAME_LENGTH = NAME_MAX;
+#else
+		std::size_t constexpr MAX_NAME_LENGTH = 255;
+#endif
+		// Below this many targets in a directory, probing each of them is cheaper than listing the directory.
+		std::size_t constexpr LISTING_THRESHOLD = 16;
+
+		auto isSeparator(char character) -> bool {
+			return character == '/' || character == std::filesystem::path::preferred_separator;
+		}
+
+		auto checkName(std::string_view name) -> std::optional<Issue> {
+			if (name.empty()) {
+				return Issue::EMPTY_NAME;
+			}
+			if (name.find('\0') != std::string_view::npos) {
+				return Issue::INVALID_CHARACTER;
+			}
+			for (std::size_t begin = 0; begin <= name.size(); ) {
+				auto end = begin;
+				for (; end < name.size() && !isSeparator(name[end]); ++end) {
+				}
+				auto component = name.substr(begin, end - begin);
+				if (component.empty() || component == "." || component == "..") {
+					return Issue::INVALID_COMPONENT;
+				}
+				if (component.size() > MAX_NAME_LENGTH) {
+					return Issue::NAME_TOO_LONG;
+				}
+				begin = end + 1;
+			}
+			return std::nullopt;
+		}
+	} // namespace
+
+	auto describe(Issue issue) -> char const* {
+		switch (issue) {
+			case Issue::EMPTY_NAME: {
+				return "name is empty";
+			}
+			case Issue::INVALID_CHARACTER: {
+				return "name contains invalid characters";
+			}
+			case Issue::INVALID_COMPONENT: {
+				return "name contains an empty, '.' or '..' component";
+			}
+			case Issue::NAME_TOO_LONG: {
+				return "name is too long";
+			}
+			case Issue::DUPLICATE: {
+				return "name is used by another file";
+			}
+			case Issue::ALREADY_EXISTS: {
+				return "file already exists";
+			}
+		}
+		return "unknown issue";
+	}
+
+	auto validate(Core::Previews const& previews) -> Report {
+		std::vector<std::optional<Issue>> issues(previews.size());
+		std::vector<std::filesystem::path> targets(previews.size());
+		detail::parallelFor(previews.size(), 4096, [&](std::size_t begin, std::size_t end) -> void {
+			for (auto current = begin; current < end; ++current) {
+				auto const& preview = previews[current];
+				issues[current] = checkName(preview.newName);
+				if (issues[current]) {
+					continue;
+				}
+				targets[current] = (preview.origin->parent_path() / preview.newName).lexically_normal();
+				if (targets[current] == *(preview.origin)) {
+					targets[current].clear();
+				}
+			}
+		});
+
+		std::unordered_set<std::string> sources;
+		std::unordered_map<std::string, std::size_t> firstUsers;
+		for (std::size_t i = 0; i < previews.size(); ++i) {
+			if (targets[i].empty()) {
+				continue;
+			}
+			sources.insert(previews[i].origin->native());
+			if (auto inserted = firstUsers.emplace(targets[i].native(), i); !inserted.second) {
+				issues[i] = Issue::DUPLICATE;
+				issues[inserted.first->second] = Issue::DUPLICATE;
+			}
+		}
+
+		// A target might already be taken, unless by a file which is moved away in the same batch.
+		std::unordered_map<std::string, std::vector<std::size_t>> groups;
+		for (std::size_t i = 0; i < previews.size(); ++i) {
+			if (!targets[i].empty() && !issues[i]) {
+				groups[targets[i].parent_path().native()].push_back(i);
+			}
+		}
+		std::vector<std::vector<std::size_t> const*> groupList;
+		groupList.reserve(groups.size());
+		for (auto const& group: groups) {
+			groupList.push_back(&group.second);
+		}
+		detail::parallelFor(groupList.size(), 1, [&](std::size_t begin, std::size_t end) -> void {
+			for (auto current = begin; current < end; ++current) {
+				auto const& group = *(groupList[current]);
+				auto isTaken = [&sources, &targets](std::size_t index, bool exists) -> bool {
+					return exists && sources.count(targets[index].native()) == 0;
+				};
+				std::error_code errorCode;
+				if (group.size() < LISTING_THRESHOLD) {
+					for (auto index: group) {
+						if (isTaken(index, std::filesystem::exists(std::filesystem::symlink_status(targets[index], errorCode)))) {
+							issues[index] = Issue::ALREADY_EXISTS;
+						}
+					}
+					continue;
+				}
+				std::unordered_set<std::string> names;
+				std::filesystem::directory_iterator entry(targets[group.front()].parent_path(), errorCode);
+				for (; !errorCode && entry != std::filesystem::directory_iterator(); entry.increment(errorCode)) {
+					names.insert(entry->path().filename().native());
+				}
+				for (auto index: group) {
+					if (isTaken(index, names.count(targets[index].filename().native()) > 0)) {
+						issues[index] = Issue::ALREADY_EXISTS;
+					}
+				}
+			}
+		});
+
+		Report result;
+		for (std::size_t i = 0; i < previews.size(); ++i) {
+			if (issues[i]) {
+				result.problems.push_back(Problem { i, *issues[i] });
+			}
+		}
+		return result;
+	}
+} // namespace dtool::renamer::commit
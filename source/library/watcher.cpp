@@ -0,0 +1,308 @@
+#include <dtool/renamer.hpp>
+
+#if defined(__linux__)
+#	include <poll.h>
+#	include <time.h>
+#	include <unistd.h>
+#	include <sys/inotify.h>
+#	include <sys/stat.h>
+#endif
+
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+namespace dtool::renamer {
+	namespace {
+		constexpr std::string_view RESERVED_PREFIX = ".drename-";
+
+		auto isReserved(std::string_view name) -> bool {
+			return name.substr(0, RESERVED_PREFIX.size()) == RESERVED_PREFIX;
+		}
+	} // namespace
+
+	Watcher::Watcher(
+		std::filesystem::path const& directory, Pattern pattern, Options options
+	): m_directory(std::filesystem::canonical(directory)), m_pattern(std::move(pattern)), m_options(std::move(options)), m_counter(0) {
+		if (!std::filesystem::is_directory(this->m_directory)) {
+			throw std::filesystem::filesystem_error(
+				"Not a directory", directory, std::make_error_code(std::errc::not_a_directory)
+			);
+		}
+		if (this->m_options.counterFile.empty()) {
+			this->m_options.counterFile = this->m_directory / (std::string(RESERVED_PREFIX) + "counter");
+		}
+		if (std::ifstream in(this->m_options.counterFile); in) {
+			in >> this->m_counter;
+		}
+	}
+
+	auto Watcher::persistCounter() const -> void {
+		auto temporary = this->m_options.counterFile;
+		temporary += ".new";
+		{
+			std::ofstream out(temporary, std::ios::trunc);
+			out << this->m_counter << '\n';
+			if (!out) {
+				throw std::filesystem::filesystem_error(
+					"Cannot write counter", temporary, std::make_error_code(std::errc::io_error)
+				);
+			}
+		}
+		std::filesystem::rename(temporary, this->m_options.counterFile);
+	}
+
+#if defined(__linux__)
+	namespace {
+		struct Inotify {
+			public: using Self = Inotify;
+			public: struct Event {
+				std::string name;
+				std::uint32_t mask;
+			};
+			public: int descriptor;
+			public: Inotify(std::filesystem::path const& directory): descriptor(::inotify_init1(IN_CLOEXEC)) {
+				if (this->descriptor < 0) {
+					throw std::system_error(errno, std::generic_category(), "Cannot initialize inotify");
+				}
+				if (::inotify_add_watch(this->descriptor, directory.c_str(), IN_CREATE | IN_CLOSE_WRITE | IN_MOVED_TO | IN_ONLYDIR) < 0) {
+					auto errorCode = errno;
+					::close(this->descriptor);
+					throw std::system_error(errorCode, std::generic_category(), "Cannot watch " + directory.string());
+				}
+			}
+			public: Inotify(Self const&) = delete;
+			public: auto operator =(Self const&) -> Self& = delete;
+			public: ~Inotify() noexcept {
+				::close(this->descriptor);
+			}
+			// Waits at most `timeout` milliseconds(forever if negative) and appends events about files in the directory,
+			// and overflows of the event queue with an empty name.
+			public: auto collect(int timeout, std::vector<Event>& events) -> void {
+				pollfd target { this->descriptor, POLLIN, 0 };
+				auto polled = ::poll(&target, 1, timeout);
+				if (polled < 0 && errno != EINTR) {
+					throw std::system_error(errno, std::generic_category(), "Cannot poll inotify");
+				}
+				if (polled <= 0) {
+					return;
+				}
+				alignas(inotify_event) char buffer[4096];
+				auto length = ::read(this->descriptor, buffer, sizeof(buffer));
+				if (length < 0) {
+					if (errno == EINTR || errno == EAGAIN) {
+						return;
+					}
+					throw std::system_error(errno, std::generic_category(), "Cannot read inotify");
+				}
+				for (char const* current = buffer; current < buffer + length; ) {
+					auto const* event = reinterpret_cast<inotify_event const*>(current);
+					if ((event->mask & IN_Q_OVERFLOW) != 0) {
+						events.push_back(Event { std::string(), IN_Q_OVERFLOW });
+					} else if (event->len > 0 && (event->mask & IN_ISDIR) == 0) {
+						events.push_back(Event { event->name, event->mask });
+					}
+					current += sizeof(inotify_event) + event->len;
+				}
+			}
+		};
+
+		auto coarseNow() -> timespec {
+			timespec result;
+			::clock_gettime(CLOCK_REALTIME_COARSE, &result);
+			return result;
+		}
+
+		using Identity = std::pair<dev_t, ino_t>;
+
+		// Returns the device and inode of a file not following symbolic links, or zeros if it is missing.
+		auto identityOf(std::filesystem::path const& path) -> Identity {
+			struct stat status;
+			if (::lstat(path.c_str(), &status) != 0) {
+				return Identity(0, 0);
+			}
+			return Identity(status.st_dev, status.st_ino);
+		}
+
+		auto isRegularFile(std::filesystem::path const& path) -> bool {
+			struct stat status;
+			return ::lstat(path.c_str(), &status) == 0 && S_ISREG(status.st_mode);
+		}
+
+		// Appends names of entries of `directory` changed since `mark`, for events lost in an overflow. File times
+		// come from the coarse clock, so `mark` must be read from it as well.
+		auto rescan(std::filesystem::path const& directory, timespec mark, std::vector<std::string>& names) -> void {
+			std::error_code errorCode;
+			std::filesystem::directory_iterator entry(directory, errorCode);
+			for (; !errorCode && entry != std::filesystem::directory_iterator(); entry.increment(errorCode)) {
+				struct stat status;
+				if (::lstat(entry->path().c_str(), &status) != 0 || S_ISDIR(status.st_mode)) {
+					continue;
+				}
+				if (status.st_ctim.tv_sec > mark.tv_sec || (status.st_ctim.tv_sec == mark.tv_sec && status.st_ctim.tv_nsec >= mark.tv_nsec)) {
+					names.push_back(entry->path().filename().string());
+				}
+			}
+		}
+	} // namespace
+
+	auto Watcher::run(BatchHandler const& handler) -> void {
+		Inotify inotify(this->m_directory);
+		auto counterName = this->m_options.counterFile.filename().string();
+		// Our own renames inside the watched directory are reported back as new arrivals. They are skipped once.
+		std::unordered_set<std::string> produced;
+		// Targets of the last batch, which a rescan might find again after their events are consumed.
+		std::unordered_set<std::string> lastProduced;
+		// Files created but not yet closed after writing, which are renamed once they are.
+		std::unordered_set<std::string> writing;
+		// Files of a failed batch, tried again with the next one.
+		std::vector<std::string> retried;
+		std::vector<Inotify::Event> events;
+		std::vector<std::string> names;
+		for (; ; ) {
+			auto mark = coarseNow();
+			events.clear();
+			inotify.collect(-1, events);
+			auto deadline = std::chrono::steady_clock::now() + this->m_options.window;
+			for (auto now = std::chrono::steady_clock::now(); now < deadline; now = std::chrono::steady_clock::now()) {
+				inotify.collect(static_cast<int>(
+					std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now).count()
+				) + 1, events);
+			}
+			names.clear();
+			names.swap(retried);
+			bool overflowed = false;
+			for (auto& event: events) {
+				if ((event.mask & IN_Q_OVERFLOW) != 0) {
+					overflowed = true;
+				} else if ((event.mask & IN_CREATE) != 0) {
+					// Only regular files are written after creation, anything else is complete already.
+					if (isRegularFile(this->m_directory / event.name)) {
+						writing.insert(std::move(event.name));
+					} else {
+						names.push_back(std::move(event.name));
+					}
+				} else if ((event.mask & IN_CLOSE_WRITE) != 0) {
+					// Rewrites of files which have been there are not arrivals.
+					if (writing.erase(event.name) > 0) {
+						names.push_back(std::move(event.name));
+					}
+				} else {
+					writing.erase(event.name);
+					names.push_back(std::move(event.name));
+				}
+			}
+			if (overflowed) {
+				// Events of our own renames are either consumed or lost by now, and newer files are rescanned.
+				produced.clear();
+				writing.clear();
+				rescan(this->m_directory, mark, names);
+			}
+			Core::Paths paths;
+			Core::Previews previews;
+			NameArena newNames;
+			for (auto const& name: names) {
+				if (name == counterName || name == counterName + ".new" || isReserved(name) || produced.erase(name) > 0) {
+					continue;
+				}
+				if (overflowed && lastProduced.count(name) > 0) {
+					continue;
+				}
+				auto path = this->m_directory / name;
+				if (!std::filesystem::exists(std::filesystem::symlink_status(path))) {
+					continue;
+				}
+				if (auto inserted = paths.insert(std::move(path)); inserted.second) {
+					previews.push_back(Core::Preview { inserted.first, newNames.store(this->m_pattern.generate(
+						name, ItemIndex::fromUnderlyingIndex(this->m_counter + previews.size())
+					)) });
+				}
+			}
+			if (previews.empty()) {
+				continue;
+			}
+			// Entries rejected by validation are reported and left alone, and the rest are committed. Dropping one
+			// might invalidate another which expected it to move away, so this repeats until the plan passes. Indices
+			// of rejected entries are taken as well, so they are not tried again with the same names.
+			auto batchSize = previews.size();
+			Core::Previews rejected;
+			std::exception_ptr rejection;
+			std::optional<commit::Plan> plan;
+			while (!previews.empty()) {
+				try {
+					plan = commit::plan(previews);
+					break;
+				} catch (BadCommit const& exception) {
+					rejection = std::current_exception();
+					std::vector<bool> isRejected(previews.size(), false);
+					for (auto const& problem: exception.report().problems) {
+						isRejected[problem.index] = true;
+					}
+					Core::Previews accepted;
+					for (std::size_t i = 0; i < previews.size(); ++i) {
+						(isRejected[i] ? rejected : accepted).push_back(previews[i]);
+					}
+					previews = std::move(accepted);
+				}
+			}
+			std::exception_ptr error;
+			std::vector<std::filesystem::path> targets;
+			std::vector<Identity> identities;
+			lastProduced.clear();
+			try {
+				// Targets are recorded and indices are taken before executing, so that a batch failing halfway
+				// neither renames its finished files again nor reuses their indices.
+				for (auto const& preview: previews) {
+					targets.push_back((preview.origin->parent_path() / preview.newName).lexically_normal());
+					identities.push_back(identityOf(*(preview.origin)));
+					if (targets.back() != *(preview.origin) && targets.back().parent_path() == this->m_directory) {
+						lastProduced.insert(targets.back().filename().string());
+					}
+				}
+				produced.insert(lastProduced.begin(), lastProduced.end());
+				this->m_counter += batchSize;
+				this->persistCounter();
+				if (plan) {
+					commit::execute(*plan, this->m_options.commitOptions);
+				}
+			} catch (...) {
+				error = std::current_exception();
+				for (std::size_t i = 0; i < previews.size(); ++i) {
+					auto const& origin = *(previews[i].origin);
+					// A file still found at its origin has not been moved, as it would have been replaced otherwise.
+					if (i < identities.size() && (targets[i] == origin || identityOf(origin) != identities[i])) {
+						continue;
+					}
+					retried.push_back(origin.filename().string());
+					if (i < targets.size()) {
+						produced.erase(targets[i].filename().string());
+						lastProduced.erase(targets[i].filename().string());
+					}
+				}
+			}
+			if (!rejected.empty() && !handler(rejected, rejection)) {
+				return;
+			}
+			if (!previews.empty() && !handler(previews, error)) {
+				return;
+			}
+		}
+	}
+#else
+	auto Watcher::run(BatchHandler const& handler) -> void {
+		throw std::runtime_error("Watch mode is only supported on Linux");
+	}
+#endif
+} // namespace dtool::renamer